@@ -0,0 +1,346 @@
+#ifndef __SHMRING_HPP__
+#define __SHMRING_HPP__
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Single producer / single consumer ring buffer in POSIX shared memory (/dev/shm) for passing MIDI messages
+// between two udpmiditransceiver instances on the same host without going through ENet/UDP.
+//
+// Each slot carries one MIDI message exactly as it would be sent in one ENet packet, so the framing is the same
+// as on the network path. Producer and consumer only touch the shared head/tail counters on the hot path; the
+// consumer sleeps on a futex when the ring is empty and the producer only does a wake-up syscall when the consumer
+// has announced it is sleeping.
+//
+// The consumer (receiving side, -shm-in) creates the segment and the producer (sending side, -shm-out) attaches to
+// it. Both sides hold an open file description lock on their own byte of the segment for as long as they are
+// attached, which keeps out a second producer or consumer and lets the producer notice when the consumer is gone.
+// The kernel drops these locks when the process exits, however it exits.
+//
+// By default the segment gets its permissions from the umask of the receiver, so only the same user (and group,
+// depending on umask) can attach as sender. With shared = true (-shm-shared) it is made readable/writable for all
+// users so that e.g. containers running as different users can share it. Note that then ANY local user can inject
+// MIDI messages, take the sender lock to keep the real sender out, or scramble the ring counters. The consumer
+// validates what it reads so a scrambled ring cannot crash it, but it cannot tell real messages from injected ones.
+//
+// The segment is left in /dev/shm on exit so that either side can be restarted; remove it with
+// 'rm /dev/shm/udpmiditransceiver-<name>' when no longer needed.
+
+#define SHMRING_SLOTS 256           // Must be a power of two
+#define SHMRING_SLOT_SIZE 1020      // Longest MIDI message (e.g. sysex) that fits into one slot
+#define SHMRING_MAGIC 0x4D494449    // "MIDI", marks segment as initialized
+#define SHMRING_VERSION 1           // Bump whenever SHMRingLayout changes
+#define SHMRING_MODE_SHARED 0666
+
+#ifdef __linux__
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Atomics shared between processes only work if they do not fall back to a process local lock
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "std::atomic<uint32_t> must be lock-free to live in shared memory");
+
+// Byte offsets in the segment used for locking, one for each side
+#define SHMRING_LOCK_CONSUMER 0
+#define SHMRING_LOCK_PRODUCER 1
+
+struct SHMRingSlot {
+	uint32_t Length;
+	unsigned char Data[SHMRING_SLOT_SIZE];
+};
+
+struct SHMRingLayout {
+	std::atomic<uint32_t> Magic;                // Written last when initializing
+	uint32_t Version;
+	uint32_t SlotCount;
+	uint32_t SlotSize;
+	alignas(64) std::atomic<uint32_t> Head;     // Written by producer only, also used as futex word
+	alignas(64) std::atomic<uint32_t> Tail;     // Written by consumer only
+	std::atomic<uint32_t> Waiting;              // Set by consumer while sleeping on Head
+	alignas(64) SHMRingSlot Slots[SHMRING_SLOTS];
+};
+
+class SHMRing {
+public:
+	SHMRing() : Ring(NULL), Fd(-1), Dropped(0) {}
+	~SHMRing() { Close(); }
+
+	static bool Supported() { return(true); }
+
+	// Creates (or re-attaches to) the named segment as its consumer. Messages left over from an earlier run are discarded.
+	bool Create(std::string name, bool shared) {
+		Close();
+		std::string path = SegmentName(name);
+		int fd = shm_open(path.c_str(), O_RDWR | O_CREAT, SHMRING_MODE_SHARED);
+		if (fd < 0) {
+			printf("Shared memory segment '%s' could not be created: %s\n", path.c_str(), strerror(errno));
+			return(false);
+		}
+		// Applied also to a segment left over from an earlier run, which may have been shared or not
+		mode_t mask = umask(0);
+		umask(mask);
+		if (fchmod(fd, shared ? SHMRING_MODE_SHARED : (SHMRING_MODE_SHARED & ~mask)) != 0 && shared) {
+			printf("Shared memory segment '%s' could not be made accessible for all users: %s\n", path.c_str(), strerror(errno));
+			::close(fd);
+			return(false);
+		}
+
+		if (!Lock(fd, SHMRING_LOCK_CONSUMER)) {
+			if (errno == EAGAIN || errno == EACCES) printf("Shared memory segment '%s' already has a receiver attached!\n", path.c_str());
+			else printf("Shared memory segment '%s' could not be locked: %s\n", path.c_str(), strerror(errno));
+			::close(fd);
+			return(false);
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			printf("Shared memory segment '%s' could not be inspected: %s\n", path.c_str(), strerror(errno));
+			::close(fd);
+			return(false);
+		}
+		SHMRingLayout* ring = NULL;
+		if (st.st_size == (off_t) sizeof(SHMRingLayout)) {
+			ring = Map(fd, path);
+			if (ring == NULL) return(false);
+		}
+		if (ring == NULL || !IsCompatible(ring)) {
+			// Leftover from a different build. Only safe to reinitialize if no producer is still writing with the old layout.
+			if (IsLocked(fd, SHMRING_LOCK_PRODUCER)) {
+				printf("Shared memory segment '%s' has an incompatible layout and a sender is still attached!\n", path.c_str());
+				if (ring != NULL) munmap((void*) ring, sizeof(SHMRingLayout));
+				::close(fd);
+				return(false);
+			}
+			if (ring != NULL) munmap((void*) ring, sizeof(SHMRingLayout));
+			if (ftruncate(fd, sizeof(SHMRingLayout)) != 0) {
+				printf("Shared memory segment '%s' could not be sized: %s\n", path.c_str(), strerror(errno));
+				::close(fd);
+				return(false);
+			}
+			ring = Map(fd, path);
+			if (ring == NULL) return(false);
+			ring->Magic.store(0, std::memory_order_relaxed);
+			ring->Version = SHMRING_VERSION;
+			ring->SlotCount = SHMRING_SLOTS;
+			ring->SlotSize = SHMRING_SLOT_SIZE;
+			ring->Head.store(0, std::memory_order_relaxed);
+			ring->Tail.store(0, std::memory_order_relaxed);
+			ring->Waiting.store(0, std::memory_order_relaxed);
+			ring->Magic.store(SHMRING_MAGIC, std::memory_order_release);
+		}
+		else ring->Tail.store(ring->Head.load(std::memory_order_acquire), std::memory_order_release);
+
+		Attach(ring, fd);
+		return(true);
+	}
+
+	// Attaches to the named segment as its producer. Fails quietly if the consumer has not created it yet or is not running.
+	bool Open(std::string name) {
+		Close();
+		std::string path = SegmentName(name);
+		int fd = shm_open(path.c_str(), O_RDWR, 0);
+		if (fd < 0) {
+			if (errno != ENOENT) printf("Shared memory segment '%s' could not be opened: %s\n", path.c_str(), strerror(errno));
+			return(false);
+		}
+		if (!IsLocked(fd, SHMRING_LOCK_CONSUMER)) {
+			::close(fd);
+			return(false);
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			printf("Shared memory segment '%s' could not be inspected: %s\n", path.c_str(), strerror(errno));
+			::close(fd);
+			return(false);
+		}
+		if (st.st_size != (off_t) sizeof(SHMRingLayout)) {
+			printf("Shared memory segment '%s' has an incompatible layout!\n", path.c_str());
+			::close(fd);
+			return(false);
+		}
+		SHMRingLayout* ring = Map(fd, path);
+		if (ring == NULL) return(false);
+		if (!IsCompatible(ring)) {
+			printf("Shared memory segment '%s' has an incompatible layout!\n", path.c_str());
+			munmap((void*) ring, sizeof(SHMRingLayout));
+			::close(fd);
+			return(false);
+		}
+		if (!Lock(fd, SHMRING_LOCK_PRODUCER)) {
+			if (errno == EAGAIN || errno == EACCES) printf("Shared memory segment '%s' already has a sender attached!\n", path.c_str());
+			else printf("Shared memory segment '%s' could not be locked: %s\n", path.c_str(), strerror(errno));
+			munmap((void*) ring, sizeof(SHMRingLayout));
+			::close(fd);
+			return(false);
+		}
+
+		Attach(ring, fd);
+		return(true);
+	}
+
+	// Safe to call while the MIDI callback thread may be in Push(), which then just counts its message as dropped
+	void Close() {
+		SHMRingLayout* ring;
+		int fd;
+		{
+			std::lock_guard<std::mutex> guard(RingMutex);
+			ring = Ring;
+			fd = Fd;
+			Ring = NULL;
+			Fd = -1;
+		}
+		if (ring != NULL) munmap((void*) ring, sizeof(SHMRingLayout));
+		if (fd >= 0) ::close(fd);
+	}
+
+	// Producer side. Checks (without taking it) whether the consumer still holds its lock.
+	bool ConsumerAlive() {
+		return(Fd >= 0 && IsLocked(Fd, SHMRING_LOCK_CONSUMER));
+	}
+
+	// Producer side. Returns false and counts the message as dropped if not attached, the ring is full or the message does not fit into a slot.
+	bool Push(const std::vector<unsigned char>& message) {
+		std::lock_guard<std::mutex> guard(RingMutex);
+		if (Ring == NULL || message.size() > SHMRING_SLOT_SIZE) {
+			Dropped.fetch_add(1, std::memory_order_relaxed);
+			return(false);
+		}
+		uint32_t head = Ring->Head.load(std::memory_order_relaxed);
+		uint32_t tail = Ring->Tail.load(std::memory_order_acquire);
+		if (head - tail >= SHMRING_SLOTS) {
+			Dropped.fetch_add(1, std::memory_order_relaxed);
+			return(false);
+		}
+
+		SHMRingSlot& slot = Ring->Slots[head & (SHMRING_SLOTS - 1)];
+		slot.Length = message.size();
+		if (!message.empty()) memcpy(slot.Data, &message[0], message.size());
+
+		Ring->Head.store(head + 1, std::memory_order_seq_cst);
+		if (Ring->Waiting.load(std::memory_order_seq_cst)) Futex(Ring, FUTEX_WAKE, 1, NULL);
+		return(true);
+	}
+
+	// Producer side. Returns number of messages dropped since the previous call.
+	unsigned int TakeDropped() {
+		return(Dropped.exchange(0, std::memory_order_relaxed));
+	}
+
+	// Consumer side. Waits at most timeout milliseconds for a message, returns false if none arrived.
+	bool Pop(std::vector<unsigned char>& message, unsigned int timeout) {
+		uint32_t tail = Ring->Tail.load(std::memory_order_relaxed);
+		uint32_t head = Ring->Head.load(std::memory_order_acquire);
+		if (head == tail) {
+			if (timeout == 0) return(false);
+			Ring->Waiting.store(1, std::memory_order_seq_cst);
+			if (Ring->Head.load(std::memory_order_seq_cst) == tail) {
+				struct timespec ts;
+				ts.tv_sec = timeout / 1000;
+				ts.tv_nsec = (timeout % 1000) * 1000000L;
+				Futex(Ring, FUTEX_WAIT, tail, &ts);
+			}
+			Ring->Waiting.store(0, std::memory_order_relaxed);
+			head = Ring->Head.load(std::memory_order_acquire);
+			if (head == tail) return(false);
+		}
+
+		// Length is read once and checked, the segment may be writable by others than our producer
+		const SHMRingSlot& slot = Ring->Slots[tail & (SHMRING_SLOTS - 1)];
+		uint32_t length = slot.Length;
+		bool valid = length <= SHMRING_SLOT_SIZE;
+		if (valid) message.assign(slot.Data, slot.Data + length);
+		Ring->Tail.store(tail + 1, std::memory_order_release);
+		return(valid);
+	}
+
+private:
+	SHMRingLayout* Ring;
+	int Fd;
+	std::mutex RingMutex;               // Guards Ring against Close()/Open() while the MIDI callback thread is in Push()
+	std::atomic<unsigned int> Dropped;  // Process local, incremented from the MIDI callback thread
+
+	static std::string SegmentName(std::string name) {
+		return("/udpmiditransceiver-" + name);
+	}
+
+	void Attach(SHMRingLayout* ring, int fd) {
+		std::lock_guard<std::mutex> guard(RingMutex);
+		Ring = ring;
+		Fd = fd;
+	}
+
+	// Closes fd on failure
+	static SHMRingLayout* Map(int fd, std::string path) {
+		void* addr = mmap(NULL, sizeof(SHMRingLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			printf("Shared memory segment '%s' could not be mapped: %s\n", path.c_str(), strerror(errno));
+			::close(fd);
+			return(NULL);
+		}
+		return((SHMRingLayout*) addr);
+	}
+
+	static bool IsCompatible(SHMRingLayout* ring) {
+		return(ring->Magic.load(std::memory_order_acquire) == SHMRING_MAGIC && ring->Version == SHMRING_VERSION
+			&& ring->SlotCount == SHMRING_SLOTS && ring->SlotSize == SHMRING_SLOT_SIZE);
+	}
+
+	// Open file description locks belong to the descriptor rather than the process, so they also conflict
+	// within one process and are released only when the descriptor is closed or the process dies
+	static bool Lock(int fd, int byte) {
+		struct flock fl;
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = byte;
+		fl.l_len = 1;
+		return(fcntl(fd, F_OFD_SETLK, &fl) == 0);
+	}
+
+	static bool IsLocked(int fd, int byte) {
+		struct flock fl;
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = byte;
+		fl.l_len = 1;
+		if (fcntl(fd, F_OFD_GETLK, &fl) != 0) return(false);
+		return(fl.l_type != F_UNLCK);
+	}
+
+	// Shared (not process private) futex on the head counter, as producer and consumer live in different processes
+	static long Futex(SHMRingLayout* ring, int op, uint32_t value, const struct timespec* timeout) {
+		return(syscall(SYS_futex, (uint32_t*) &ring->Head, op, value, timeout, NULL, 0));
+	}
+};
+
+#else
+
+// Shared memory transport is only implemented for Linux, callers should check Supported() before using it
+class SHMRing {
+public:
+	static bool Supported() { return(false); }
+	bool Create(std::string name, bool shared) { return(false); }
+	bool Open(std::string name) { return(false); }
+	void Close() {}
+	bool ConsumerAlive() { return(false); }
+	bool Push(const std::vector<unsigned char>& message) { return(false); }
+	unsigned int TakeDropped() { return(0); }
+	bool Pop(std::vector<unsigned char>& message, unsigned int timeout) { return(false); }
+};
+
+#endif
+
+#endif
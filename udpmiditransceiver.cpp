@@ -2,12 +2,15 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <chrono>
+#include <thread>
 
 #include <enet/enet.h>
 
 #include "RtMidi.h"
 
 #include "MIDI2STR.hpp"
+#include "SHMRING.hpp"
 
 /*
 	Tested using GCC version 5.4.0. Requires libraries rtmidi-4.0.0 and enet-1.3.15. Be sure you have ran their configure & make scripts. 
@@ -25,6 +28,8 @@
 
 	  c++ -Irtmidi-4.0.0 udpmiditransceiver.cpp /usr/local/lib/libenet.so /usr/local/lib/librtmidi.so -o udpmiditransceiver
 
+	  On older glibc versions add -lrt for shm_open
+
 	Windows / Visual Studio 2019:
 	  - Add preprocessor directives __WINDOWS_MM__ and _WIN32
 	  - Add additional linker dependencies winmm.lib, enet.lib, ws2_32.lib
@@ -45,6 +50,7 @@
 RtMidiIn* MIDIin = 0;
 RtMidiOut* MIDIout = 0;
 ENetPeer* Peer;
+SHMRing* RingOut = 0;
 
 // These could be improved / made fail-safe / replaced with some library
 bool isoption(int argc, char* argv[], std::string option);
@@ -55,6 +61,8 @@ unsigned int GetMIDIPort(std::string name);
 
 void MIDICallback(double deltatime, std::vector< unsigned char >* message, void* userData); 
 void MIDICallbackSilent(double deltatime, std::vector< unsigned char >* message, void* userData);
+void MIDICallbackShm(double deltatime, std::vector< unsigned char >* message, void* userData);
+void MIDICallbackShmSilent(double deltatime, std::vector< unsigned char >* message, void* userData);
 
 int main(int argc, char* argv[]) {
 	printf("udpmiditransceiver\n\n");
@@ -85,12 +93,17 @@ int main(int argc, char* argv[]) {
 
 	// Options that need to be set, some initiated to default value
 	bool UseIn = false;
+	bool ShmIn = false;
 	unsigned int PortIn;
+	std::string ShmNameIn;
 	//std::string DeviceIn;
 	unsigned int DeviceIn;
 
 	bool UseOut = false;
+	bool ShmOut = false;
 	std::string HostOut;
+	std::string ShmNameOut;
+	bool ShmShared = false;
 	unsigned int PortOut;
 	//std::string DeviceOut;
 	unsigned int DeviceOut;
@@ -105,6 +118,20 @@ int main(int argc, char* argv[]) {
 
 	// These checkups could be improved / made fail-safe / replaced with some library
 
+	bool ShmOption = isoption(argc, argv, "-shm-in") || isoption(argc, argv, "-shm-out") || isoption(argc, argv, "-shm-shared");
+	if (ShmOption && !SHMRing::Supported()) {
+		printf("Shared memory transport is not supported on this platform!\n");
+		exit(EXIT_FAILURE);
+	}
+	if (isoption(argc, argv, "-shm-in") && isoption(argc, argv, "-port-in")) {
+		printf("Options -shm-in and -port-in cannot be used together!\n");
+		exit(EXIT_FAILURE);
+	}
+	if (isoption(argc, argv, "-shm-out") && (isoption(argc, argv, "-host-out") || isoption(argc, argv, "-port-out"))) {
+		printf("Option -shm-out cannot be used together with -host-out or -port-out!\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if (isoption(argc, argv, "-port-in")) {
 		PortIn = atoi(getoptionvalue(argc, argv, "-port-in").c_str());
 		if (isoption(argc, argv, "-device-in")) {
@@ -113,6 +140,16 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
+	// Local shared memory transport replaces -port-in / -host-out & -port-out when both ends are on the same host
+	if (isoption(argc, argv, "-shm-in")) {
+		ShmNameIn = getoptionvalue(argc, argv, "-shm-in");
+		if (isoption(argc, argv, "-device-in")) {
+			DeviceIn = atoi(getoptionvalue(argc, argv, "-device-in").c_str());
+			UseIn = true;
+			ShmIn = true;
+		}
+	}
+
 	if (isoption(argc, argv, "-host-out")) {
 		HostOut = getoptionvalue(argc, argv, "-host-out");
 		if (isoption(argc, argv, "-port-out")) {
@@ -124,6 +161,17 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
+	if (isoption(argc, argv, "-shm-out")) {
+		ShmNameOut = getoptionvalue(argc, argv, "-shm-out");
+		if (isoption(argc, argv, "-device-out")) {
+			DeviceOut = atoi(getoptionvalue(argc, argv, "-device-out").c_str());
+			UseOut = true;
+			ShmOut = true;
+		}
+	}
+
+	if (isoption(argc, argv, "-shm-shared")) ShmShared = true;
+
 	if (isoption(argc, argv, "-polling-time")) PollingTime = atoi(getoptionvalue(argc, argv, "-polling-time").c_str());
 
 	if (isoption(argc, argv, "-timing")) IgnoreTiming = false;
@@ -146,7 +194,12 @@ int main(int argc, char* argv[]) {
 		//printf("  -device-out [string]     Defines which MIDI device sends the signal (output port list)\n");
 		printf("  -device-out [integer]     Defines which MIDI device sends the signal (output port list)\n");
 		printf("\n");
-		printf("  -polling-time [number]   Defines UDP polling time in milliseconds (default 1)\n");
+		printf("  -shm-in [string]         Receive MIDI signal from local shared memory ring of given name instead of UDP port (Linux only)\n");
+		printf("  -shm-out [string]        Send MIDI signal to local shared memory ring of given name instead of UDP host/port (Linux only)\n");
+		printf("  -shm-shared              Let any local user attach to the -shm-in ring, e.g. containers running as other users.\n");
+		printf("                           Note: any local user can then also inject MIDI messages or block the real sender!\n");
+		printf("\n");
+		printf("  -polling-time [number]   Defines UDP / shared memory polling time in milliseconds (default 1)\n");
 		printf("\n");
 		printf("  -timing                  Enables receiving timing related MIDI messages (default disabled)\n");
 		printf("  -sensing                 Enables receiving sensing related MIDI messages (default disabled)\n");
@@ -155,7 +208,7 @@ int main(int argc, char* argv[]) {
 		printf("  -print-midi              Prints MIDI signals received or sent (default disabled)\n");
 		printf("  -print-devices           Print available MIDI devices\n");
 		printf("\n");
-		printf("At least port-in and device-in, or host-out, port-out, device-out have to be provided.\n");
+		printf("At least port-in (or shm-in) and device-in, or host-out, port-out (or shm-out), device-out have to be provided.\n");
 		printf("\n");
 		printf("Usage examples:\n");
 		printf("\n");
@@ -163,15 +216,22 @@ int main(int argc, char* argv[]) {
 		printf("    server:   udpmiditransceiver -port-in 6666 -device-in \"loopMIDI Port 1\" -print-midi -print-devices -polling-time 1\n");
 		printf("    client:   udpmiditransceiver -host-out 192.168.1.110 -port-out 6666 -device-out \"\"\n");
 		printf("\n");
+		printf("  Routing MIDI between two processes on the same computer:\n");
+		printf("    receiver: udpmiditransceiver -shm-in synth -device-in 1\n");
+		printf("    sender:   udpmiditransceiver -shm-out synth -device-out 0\n");
+		printf("\n");
 		return(EXIT_SUCCESS);
 	}
 
 	printf("Running with parameters:\n");
 	//if (UseIn) printf(" - Receive MIDI messages through port %d to device '%s'\n", PortIn, DeviceIn.c_str());
-	if (UseIn) printf(" - Receive MIDI messages through port %d to device %d / %s \n", PortIn, DeviceIn, MIDIout->getPortName(DeviceIn).c_str());
+	if (UseIn && !ShmIn) printf(" - Receive MIDI messages through port %d to device %d / %s \n", PortIn, DeviceIn, MIDIout->getPortName(DeviceIn).c_str());
+	if (UseIn && ShmIn) printf(" - Receive MIDI messages through shared memory ring '%s' to device %d / %s \n", ShmNameIn.c_str(), DeviceIn, MIDIout->getPortName(DeviceIn).c_str());
+	if (UseIn && ShmIn && ShmShared) printf(" - Shared memory ring accessible for all local users\n");
 	//if (UseOut) printf(" - Send MIDI messages to host '%s' port %d from device '%s'\n", HostOut.c_str(), PortOut, DeviceOut.c_str());
-	if (UseOut) printf(" - Send MIDI messages to host '%s' port %d from device %d / %s\n", HostOut.c_str(), PortOut, DeviceOut, MIDIin->getPortName(DeviceOut).c_str());
-	printf(" - Use UDP polling time %d ms\n", PollingTime);
+	if (UseOut && !ShmOut) printf(" - Send MIDI messages to host '%s' port %d from device %d / %s\n", HostOut.c_str(), PortOut, DeviceOut, MIDIin->getPortName(DeviceOut).c_str());
+	if (UseOut && ShmOut) printf(" - Send MIDI messages to shared memory ring '%s' from device %d / %s\n", ShmNameOut.c_str(), DeviceOut, MIDIin->getPortName(DeviceOut).c_str());
+	printf(" - Use UDP / shared memory polling time %d ms\n", PollingTime);
 	if (!IgnoreTiming) printf(" - Receive timing related MIDI messages\n");
 	if (!IgnoreSensing) printf(" - Receive sensing related MIDI messages\n");
 	if (!IgnoreSysex) printf(" - Receive system extension related MIDI messages\n");
@@ -237,7 +297,16 @@ int main(int argc, char* argv[]) {
 	// Open inward and outward UDP connections
 	ENetAddress AddressIn;
 	ENetHost* Server = NULL;
-	if (UseIn) {
+	SHMRing* RingIn = NULL;
+	if (UseIn && ShmIn) {
+		RingIn = new SHMRing();
+		if (!RingIn->Create(ShmNameIn, ShmShared)) {
+			printf("Shared memory ring initialization failed!\n");
+			exit(EXIT_FAILURE);
+		}
+		printf("Inward shared memory ring open\n");
+	}
+	else if (UseIn) {
 		AddressIn.host = ENET_HOST_ANY;
 		AddressIn.port = PortIn;
 		Server = enet_host_create(&AddressIn, 1, 1, 0, 0);
@@ -250,7 +319,8 @@ int main(int argc, char* argv[]) {
 
 	ENetAddress AddressOut;
 	ENetHost* Client = NULL;
-	if (UseOut) {
+	if (UseOut && ShmOut) RingOut = new SHMRing();
+	else if (UseOut) {
 		enet_address_set_host(&AddressOut, HostOut.c_str());
 		AddressOut.port = PortOut;
 		Client = enet_host_create(NULL, 1, 1, 0, 0);
@@ -267,8 +337,36 @@ int main(int argc, char* argv[]) {
 	ENetEvent EventIn, EventOut;
 	while (1) { 
 
+		// Attach to local shared memory ring once the receiving side has created it
+		if (UseOut && ShmOut) {
+			if (!OutwardConnection) {
+				printf(" - Attempting to attach to shared memory ring '%s'\n", ShmNameOut.c_str());
+				if (RingOut->Open(ShmNameOut)) {
+					printf(" - Attached to shared memory ring '%s'\n", ShmNameOut.c_str());
+					OutwardConnection = true;
+					if (PrintMidi) MIDIin->setCallback(&MIDICallbackShm);
+					else MIDIin->setCallback(&MIDICallbackShmSilent);
+				}
+				else {
+					printf(" - Failed to attach\n");
+					std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+				}
+			}
+			else {
+				// Callback writes directly to the ring, here just report dropped messages and watch that the receiver is still there
+				unsigned int Dropped = RingOut->TakeDropped();
+				if (Dropped > 0) printf(" - Shared memory ring full or message too long, dropped %u messages\n", Dropped);
+				if (!RingOut->ConsumerAlive()) {
+					printf(" - Shared memory ring receiver went away\n");
+					OutwardConnection = false;
+					MIDIin->cancelCallback();
+					RingOut->Close(); // A callback still running sees the ring detached and drops its message
+				}
+				else if (!UseIn) std::this_thread::sleep_for(std::chrono::milliseconds(PollingTime));
+			}
+		}
 		// Attempt connection to outward world
-		if (UseOut) {
+		else if (UseOut) {
 			if (!OutwardConnection) {
 				// Attempt connection to outward server
 				Peer = enet_host_connect(Client, &AddressOut, 1, 0);
@@ -307,8 +405,19 @@ int main(int argc, char* argv[]) {
 			}
 		}
 
+		// Receive MIDI messages from local shared memory ring
+		if (UseIn && ShmIn) {
+			std::vector<unsigned char> msg;
+			if (RingIn->Pop(msg, PollingTime)) {
+				if (PrintMidi) {
+					std::string MIDIstr = MIDI2String(msg);
+					printf(" - Received %s\n", MIDIstr.c_str());
+				}
+				MIDIout->sendMessage(&msg);
+			}
+		}
 		// Check for inward connections and receive MIDI messages from them
-		if (UseIn) {
+		else if (UseIn) {
 			if (enet_host_service(Server, &EventIn, PollingTime) > 0){
 				switch (EventIn.type) {
 				case ENET_EVENT_TYPE_CONNECT:
@@ -359,11 +468,13 @@ int main(int argc, char* argv[]) {
 
 	// Cleanup -- We don not really reach here...
 
-	if (UseOut) {
+	if (UseOut && ShmOut) delete RingOut;
+	else if (UseOut) {
 		enet_peer_reset(Peer);
 		enet_host_destroy(Client);
 	}
-	if(UseIn) enet_host_destroy(Server);
+	if (UseIn && ShmIn) delete RingIn;
+	else if(UseIn) enet_host_destroy(Server);
 
 	delete MIDIin;
 	delete MIDIout;
@@ -422,4 +533,14 @@ void MIDICallbackSilent(double deltatime, std::vector<unsigned char>* message, v
 	for (unsigned int i = 0; i < count; i++) msg[i] = message->at(i);
 	ENetPacket* packet = enet_packet_create((void*)msg, count, ENET_PACKET_FLAG_RELIABLE);
 	enet_peer_send(Peer, 0, packet);
-}
\ No newline at end of file
+}
+
+void MIDICallbackShm(double deltatime, std::vector<unsigned char>* message, void* userData) {
+	if (!RingOut->Push(*message)) return; // Counted and reported from the main loop
+	std::string MIDIstr = MIDI2String(*message);
+	printf(" - Sent %s\n", MIDIstr.c_str());
+}
+
+void MIDICallbackShmSilent(double deltatime, std::vector<unsigned char>* message, void* userData) {
+	RingOut->Push(*message); // Dropped messages are counted and reported from the main loop
+}